@@ -38,8 +38,8 @@
 #include <stdlib.h>     // malloc, calloc, free, exit
 #include <stdbool.h>    // bool, true, false
 #include <ctype.h>      // tolower
-#include <string.h>     // strcmp
-#include <math.h>       // sinl, cosl, sqrt, ceil, floor, fmax, fmin, fmod
+#include <string.h>     // strcmp, memcpy
+#include <math.h>       // sinl, cosl, sqrt, ceil, floor, fmax, fmin, fmod, fabs, isfinite
 #include <time.h>       // nanosleep
 #include <omp.h>        // omp_get_wtime, #pragma omp
 #ifdef _DEBUG
@@ -52,6 +52,7 @@
 
 
 // Cache the sin and cos values of the angles to avoid recalculating them
+// (circular trajectory, used by the projections without a projection matrix)
 long double sinTable[N_THETA], cosTable[N_THETA];
 
 // Cache the first and last plane positions for each axis
@@ -326,13 +327,24 @@ void computeBackProjection(const projection* projection, volume* volume) {
         exit(EXIT_FAILURE);
     }
 
+    computeBackProjectionRows(projection, volume, 0, projection->nSidePixels);
+}
+
+void computeBackProjectionRows(const projection* projection, volume* volume,
+                               const int firstRow, const int lastRow) {
+    // Check if the arguments are valid
+    if (volume == NULL || projection == NULL ||
+        firstRow < 0 || lastRow > projection->nSidePixels) {
+        fprintf(stderr, "Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Get the source point of this projection
     const point3D source = getSourcePosition(projection->index);
 
-    // Iterate through every pixel of the projection image and calculate the
+    // Iterate through every pixel of the band of rows and calculate the
     // coefficients of the voxels that contribute to the pixel.
-    //#pragma omp parallel for collapse(2) schedule(dynamic)
-    for (int row = 0; row < projection->nSidePixels; row++) {
+    for (int row = firstRow; row < lastRow; row++) {
         for (int col = 0; col < projection->nSidePixels; col++) {
             const point3D pixel = getPixelPosition(projection, row, col);
             const ray ray = {.source=source, .pixel=pixel};
@@ -405,12 +417,184 @@ void computeBackProjection(const projection* projection, volume* volume) {
     }
 }
 
+void computeVoxelBackProjection(const projection* projection, volume* volume,
+                                const int voxelY) {
+    // Check if the arguments are valid
+    if (volume == NULL || projection == NULL || !projection->hasMatrix ||
+        voxelY < 0 || voxelY >= N_VOXELS_Y) {
+        fprintf(stderr, "Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const int nSidePixels = projection->nSidePixels;
+    const double maxIndex = nSidePixels - 1;
+    const double* pixels = projection->pixels;
+    const double minVal = projection->minVal;
+
+    // Determinant of the left 3x3 block M of the projection matrix and position
+    // of the source, which is the point projecting to w = 0: -M^-1 * column 4
+    const double (*m)[4] = projection->matrix;
+    const double bc[3] = {m[1][1] * m[2][2] - m[1][2] * m[2][1],
+                          m[1][2] * m[2][0] - m[1][0] * m[2][2],
+                          m[1][0] * m[2][1] - m[1][1] * m[2][0]};
+    const double ca[3] = {m[2][1] * m[0][2] - m[2][2] * m[0][1],
+                          m[2][2] * m[0][0] - m[2][0] * m[0][2],
+                          m[2][0] * m[0][1] - m[2][1] * m[0][0]};
+    const double ab[3] = {m[0][1] * m[1][2] - m[0][2] * m[1][1],
+                          m[0][2] * m[1][0] - m[0][0] * m[1][2],
+                          m[0][0] * m[1][1] - m[0][1] * m[1][0]};
+    const double det = m[0][0] * bc[0] + m[0][1] * bc[1] + m[0][2] * bc[2];
+    double source[3];
+    for (int i = 0; i < 3; i++) {
+        source[i] = -(bc[i] * m[0][3] + ca[i] * m[1][3] + ab[i] * m[2][3]) / det;
+    }
+
+    // The rays going through a voxel at distance d from the source add up to a
+    // length of V * |det M| * d / w^3 (V being the volume of the voxel), so the
+    // voxel gets the same total as if every ray was traced through it like
+    // computeAbsorption() does, with the same normalization
+    const double normalization = VOXEL_SIZE_X * VOXEL_SIZE_Y * VOXEL_SIZE_Z * fabs(det) /
+        ((projection->maxVal - projection->minVal) * (DOD + DOS));
+
+    // Homogeneous detector coordinates of the center of the first voxel of the
+    // slab and their increments when moving one voxel along the x and z axes
+    const double x = firstPlane[X] + VOXEL_SIZE_X / 2.0;
+    const double y = firstPlane[Y] + (voxelY + 0.5) * VOXEL_SIZE_Y;
+    const double z = firstPlane[Z] + VOXEL_SIZE_Z / 2.0;
+    double rowStart[3], stepX[3], stepZ[3];
+    for (int i = 0; i < 3; i++) {
+        rowStart[i] = m[i][0] * x + m[i][1] * y + m[i][2] * z + m[i][3];
+        stepX[i] = m[i][0] * VOXEL_SIZE_X;
+        stepZ[i] = m[i][2] * VOXEL_SIZE_Z;
+    }
+
+    // Homogeneous detector coordinates, squared distance from the source and
+    // distance from the source of the voxels of the current row
+    const double laneStep = VOXEL_SIMD_WIDTH * VOXEL_SIZE_X;
+    double u[N_VOXELS_X], v[N_VOXELS_X], w[N_VOXELS_X];
+    double d2[N_VOXELS_X], d2Step[N_VOXELS_X], distance[N_VOXELS_X];
+
+    for (int voxelZ = 0; voxelZ < N_VOXELS_Z; voxelZ++) {
+        // Seed one voxel per SIMD lane, then evaluate the rest of the row from
+        // the voxel VOXEL_SIMD_WIDTH positions before using additions only, so
+        // that the lanes advance independently (the squared distance is
+        // quadratic in x, so its increment grows by a constant at each step)
+        const double dy = y - source[Y];
+        const double dz = z + voxelZ * VOXEL_SIZE_Z - source[Z];
+        for (int lane = 0; lane < VOXEL_SIMD_WIDTH && lane < N_VOXELS_X; lane++) {
+            const double dx = x + lane * VOXEL_SIZE_X - source[X];
+            u[lane] = rowStart[0] + lane * stepX[0];
+            v[lane] = rowStart[1] + lane * stepX[1];
+            w[lane] = rowStart[2] + lane * stepX[2];
+            d2[lane] = dx * dx + dy * dy + dz * dz;
+            d2Step[lane] = 2 * dx * laneStep + laneStep * laneStep;
+        }
+        #pragma omp simd safelen(VOXEL_SIMD_WIDTH)
+        for (int voxelX = VOXEL_SIMD_WIDTH; voxelX < N_VOXELS_X; voxelX++) {
+            u[voxelX] = u[voxelX - VOXEL_SIMD_WIDTH] + VOXEL_SIMD_WIDTH * stepX[0];
+            v[voxelX] = v[voxelX - VOXEL_SIMD_WIDTH] + VOXEL_SIMD_WIDTH * stepX[1];
+            w[voxelX] = w[voxelX - VOXEL_SIMD_WIDTH] + VOXEL_SIMD_WIDTH * stepX[2];
+            d2[voxelX] = d2[voxelX - VOXEL_SIMD_WIDTH] + d2Step[voxelX - VOXEL_SIMD_WIDTH];
+            d2Step[voxelX] = d2Step[voxelX - VOXEL_SIMD_WIDTH] + 2 * laneStep * laneStep;
+        }
+
+        // The distances of the first row are computed exactly, the following
+        // rows refine the distance of the same voxel in the previous row, which
+        // is only one voxel away, with a step of Newton's method (sqrt() could
+        // set errno, which would keep the loop below from being vectorized)
+        if (voxelZ == 0) {
+            for (int voxelX = 0; voxelX < N_VOXELS_X; voxelX++) {
+                distance[voxelX] = sqrt(d2[voxelX]);
+            }
+        }
+
+        double* coefficients = &volume->coefficients[voxelY * N_VOXELS_X * N_VOXELS_Z + voxelZ * N_VOXELS_Z];
+
+        // Branch-free, comparisons are turned into 0/1 masks and the selects
+        // into multiplications, so that every lane runs the same instructions
+        #pragma omp simd
+        for (int voxelX = 0; voxelX < N_VOXELS_X; voxelX++) {
+            // Project the voxel center onto the detector, voxels behind (or
+            // right next to) the source get a harmless w so that the detector
+            // coordinates are always finite (the matrix is normalized so that
+            // the center of the volume has w = 1)
+            const double inFront = w[voxelX] >= MIN_W;
+            const double reciprocal = 1 / (fabs(w[voxelX]) + (1 - inFront));
+            const double col = u[voxelX] * reciprocal;
+            const double row = v[voxelX] * reciprocal;
+
+            // Voxels behind the source or projecting outside of the detector
+            // don't get any contribution
+            const double colAboveMin = col >= 0, colBelowMax = col <= maxIndex;
+            const double rowAboveMin = row >= 0, rowBelowMax = row <= maxIndex;
+            const double inside = inFront * colAboveMin * colBelowMax * rowAboveMin * rowBelowMax;
+
+            // Bilinear interpolation of the four pixels around the projected
+            // point, clamped to the detector
+            const double clampedCol = col * colAboveMin * colBelowMax + maxIndex * (1 - colBelowMax);
+            const double clampedRow = row * rowAboveMin * rowBelowMax + maxIndex * (1 - rowBelowMax);
+            const int col0 = (int)clampedCol;
+            const int row0 = (int)clampedRow;
+            const int col1 = col0 + (col0 < nSidePixels - 1);
+            const int row1 = row0 + (row0 < nSidePixels - 1);
+            const double fCol = clampedCol - col0;
+            const double fRow = clampedRow - row0;
+            const double pixelValue =
+                (1 - fRow) * ((1 - fCol) * pixels[row0 * nSidePixels + col0] +
+                              fCol * pixels[row0 * nSidePixels + col1]) +
+                fRow * ((1 - fCol) * pixels[row1 * nSidePixels + col0] +
+                        fCol * pixels[row1 * nSidePixels + col1]);
+
+            const double d = 0.5 * (distance[voxelX] + d2[voxelX] / distance[voxelX]);
+            distance[voxelX] = d;
+            const double rayLength = d * reciprocal * reciprocal * reciprocal;
+
+            coefficients[voxelX] += inside * (pixelValue - minVal) * normalization * rayLength;
+        }
+
+        for (int i = 0; i < 3; i++) {
+            rowStart[i] += stepZ[i];
+        }
+    }
+}
+
+void normalizeProjectionMatrix(projection* projection) {
+    // The center of the volume is the origin, so its w is the last element of
+    // the third row, dividing by it both fixes the sign and the scale
+    const double wCenter = projection->matrix[2][3];
+    if (wCenter == 0 || !isfinite(wCenter)) {
+        fprintf(stderr, "\nInvalid projection matrix, the center of the volume doesn't project onto the detector plane\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            projection->matrix[i][j] /= wCenter;
+            if (!isfinite(projection->matrix[i][j])) {
+                fprintf(stderr, "\nInvalid projection matrix, its values must be finite\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+void releaseProjection(projection* projection) {
+    int references;
+    #pragma omp atomic capture
+    references = --projection->references;
+
+    if (references == 0) {
+        free(projection->pixels);
+        free(projection);
+    }
+}
+
 
 int main(int argc, char* argv[]) {
     // Open the input file
     if (argc < 2) {
         fprintf(stderr, "Input file not provided\n");
-        fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input_file> <output_file> [matrices_file]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     char* inputFileName = argv[1];
@@ -438,7 +622,7 @@ int main(int argc, char* argv[]) {
     // Open the output file
     if (argc < 3) {
         fprintf(stderr, "Output file not provided\n");
-        fprintf(stderr, "Usage: %s <input_file> <output_file>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input_file> <output_file> [matrices_file]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     char* outputFileName = argv[2];
@@ -468,6 +652,23 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Open the optional projection matrices file
+    const bool hasMatricesFile = argc >= 4;
+    static double matrices[N_THETA][3][4];
+    if (hasMatricesFile) {
+        FILE* matricesFile = fopen(argv[3], "r");
+        if (matricesFile == NULL) {
+            fprintf(stderr, "Error opening projection matrices file\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!readProjectionMatrices(matricesFile, matrices, N_THETA)) {
+            fprintf(stderr, "Error reading projection matrices file, expected %d matrices\n",
+                    N_THETA);
+            exit(EXIT_FAILURE);
+        }
+        fclose(matricesFile);
+    }
+
     volume volume = {
         .nVoxelsX = N_VOXELS_X,
         .nVoxelsY = N_VOXELS_Y,
@@ -493,32 +694,94 @@ int main(int argc, char* argv[]) {
     double minVal, maxVal;
 
     // Read the projection images from the file and compute the backprojection
+    // File reading has to be done sequentially, so a single thread decodes the
+    // projections one band of rows at a time and spawns a task for each band,
+    // which the other threads backproject while the next band is being decoded
+    // Projections with a matrix are backprojected one slab of voxels per task
+    // instead, once they're fully decoded, tasks writing to the same slab are
+    // serialized through a dependency on its first voxel so no atomic is needed
+    // Band tasks aren't ordered against slab tasks, so all of the projections
+    // must either have a matrix or not
+    const bool isDAT = strcmp(inputFileExtension, ".dat") == 0;
     int processedProjections = 0;
-    #pragma omp parallel for schedule(dynamic)
+    bool useMatrices = false;
+    #pragma omp parallel
+    #pragma omp single
     for (int i = 0; i < N_THETA; i++) {
-        projection projection;
-        bool read;
+        projection* projection = (struct projection*)calloc(1, sizeof(struct projection));
+        if (projection == NULL) {
+            fprintf(stderr, "Error allocating memory for the projection\n");
+            exit(EXIT_FAILURE);
+        }
+        // The reader holds a reference until it's done decoding the projection
+        projection->references = 1;
 
-        // File reading has to be done sequentially
-        #pragma omp critical
-        if (strcmp(inputFileExtension, ".dat") == 0) {
-            read = readProjectionDAT(inputFile, &projection,
-                                    &width, &height, &minVal, &maxVal);
+        bool read;
+        if (isDAT) {
+            read = readProjectionHeaderDAT(inputFile, projection,
+                                        &width, &height, &minVal, &maxVal);
         } else {
-            read = readProjectionPGM(inputFile, &projection,
-                                    &width, &height, &minVal, &maxVal);
+            read = readProjectionHeaderPGM(inputFile, projection,
+                                        &width, &height, &minVal, &maxVal);
         }
 
         // if read is false, it means that the end of the file was reached
         if (read) {
-            #pragma omp atomic update
+            // Matrices from the file take precedence over the ones in the header
+            if (hasMatricesFile) {
+                memcpy(projection->matrix, matrices[processedProjections],
+                       sizeof(projection->matrix));
+                projection->hasMatrix = true;
+            }
+            if (processedProjections == 0) {
+                useMatrices = projection->hasMatrix;
+            } else if (projection->hasMatrix != useMatrices) {
+                fprintf(stderr, "\nProjections with and without a projection matrix can't be mixed\n");
+                exit(EXIT_FAILURE);
+            }
+            if (projection->hasMatrix) {
+                normalizeProjectionMatrix(projection);
+            }
             processedProjections++;
             fprintf(stderr, "Processing projection %d/%d\r",
                     processedProjections, N_THETA);
-            computeBackProjection(&projection, &volume);
         }
 
-        free(projection.pixels);
+        for (int firstRow = 0; read && firstRow < projection->nSidePixels;
+             firstRow += ROW_BAND_SIZE) {
+            const int lastRow = (int)fmin(firstRow + ROW_BAND_SIZE,
+                                          projection->nSidePixels);
+            if (isDAT) {
+                read = readProjectionRowsDAT(inputFile, projection, firstRow, lastRow);
+            } else {
+                read = readProjectionRowsPGM(inputFile, projection, firstRow, lastRow);
+            }
+
+            if (read && !projection->hasMatrix) {
+                #pragma omp atomic update
+                projection->references++;
+
+                #pragma omp task firstprivate(projection, firstRow, lastRow) shared(volume)
+                {
+                    computeBackProjectionRows(projection, &volume, firstRow, lastRow);
+                    releaseProjection(projection);
+                }
+            }
+        }
+
+        for (int voxelY = 0; read && projection->hasMatrix && voxelY < N_VOXELS_Y; voxelY++) {
+            #pragma omp atomic update
+            projection->references++;
+
+            #pragma omp task firstprivate(projection, voxelY) shared(volume) \
+                             depend(inout: volume.coefficients[voxelY * N_VOXELS_X * N_VOXELS_Z])
+            {
+                computeVoxelBackProjection(projection, &volume, voxelY);
+                releaseProjection(projection);
+            }
+        }
+
+        releaseProjection(projection);
     }
 
     double finalTime = omp_get_wtime();
@@ -49,6 +49,19 @@
 /// number of rays sources
 #define N_THETA ((int)((AP) / (STEP_ANGLE)) + 1)
 
+#ifndef ROW_BAND_SIZE
+    /// number of detector rows decoded before they're handed off to be backprojected
+    #define ROW_BAND_SIZE 16
+#endif
+
+#ifndef VOXEL_SIMD_WIDTH
+    /// number of voxels of a row evaluated at once by the voxel-driven backprojection
+    #define VOXEL_SIMD_WIDTH 8
+#endif
+
+/// minimum w (relative to the center of the volume) of the voxels considered in front of the source
+#define MIN_W 1e-3
+
 #if defined(_WORK_UNITS) && _WORK_UNITS > 0
     // These values will be used when running benchmarks for scalability
     #define VOXEL_MATRIX_SIZE ((int)((_WORK_UNITS) * (VOXEL_SIZE_X) * 125 / 294))
@@ -155,6 +168,12 @@ typedef struct projection {
     int nSidePixels;
     /// 2D array of size (nPixels*nPixels) containing the pixel values
     double* pixels;
+    /// Number of holders (reader and row band tasks) still using the pixels
+    int references;
+    /// 3x4 matrix mapping homogeneous world coordinates to (col, row, 1) detector coordinates
+    double matrix[3][4];
+    /// Whether the projection matrix is provided, if not the circular trajectory is used
+    bool hasMatrix;
 } projection;
 
 /**
@@ -183,6 +202,9 @@ typedef struct volume {
  *
  * These values are complex to calculate each time, so they are precomputed and
  * cached to optimize performance during backprojection operations.
+ *
+ * The sine and cosine tables describe the circular trajectory (DOS, DOD) and
+ * are only used for projections without a projection matrix.
  */
 void initTables();
 
@@ -448,3 +470,75 @@ void computeAbsorption(const ray ray, const double a[], const int lenA,
  * @param volume The volume structure containing the absorption coefficients.
  */
 void computeBackProjection(const projection* projection, volume* volume);
+
+/**
+ * @brief Computes the backprojection of a band of rows of the projection.
+ *
+ * Same as computeBackProjection() but only the rays going through the pixels
+ * of the rows in [firstRow, lastRow) are traced, so that a band can be
+ * backprojected as soon as it's been decoded, while the rest of the
+ * projection is still being read.
+ *
+ * @param projection The projection containing the projection pixels values.
+ * @param volume The volume structure containing the absorption coefficients.
+ * @param firstRow The index of the first row of the band.
+ * @param lastRow The index of the row after the last one of the band.
+ */
+void computeBackProjectionRows(const projection* projection, volume* volume,
+                               const int firstRow, const int lastRow);
+
+/**
+ * @brief Computes the voxel-driven backprojection of the projection on a slab of the volume.
+ *
+ * Unlike computeBackProjection(), which traces the rays from the source to
+ * every pixel, every voxel center of the slab is projected onto the detector
+ * using the projection matrix \f$P\f$ and receives the bilinearly interpolated
+ * value of the pixels around it, so that any trajectory can be reconstructed.
+ *
+ * \f$
+ * (u \cdot w, v \cdot w, w)^T = P \cdot (x, y, z, 1)^T
+ * \f$
+ *
+ * The matrix is evaluated incrementally along each row of voxels (x-axis),
+ * each of the VOXEL_SIMD_WIDTH lanes stepping over its own voxels, so each
+ * voxel only costs a few additions, one reciprocal of \f$w\f$ and a step of
+ * Newton's method refining its distance \f$d\f$ from the source starting
+ * from the one of the previous row. The loop over the row is branch-free so
+ * that it's vectorized.
+ * The contribution is weighted by the total length of the rays going through
+ * the voxel, so that it's on the same scale as computeAbsorption():
+ *
+ * \f$
+ * V_{voxel} \cdot |\det M| \cdot d / w^3
+ * \f$
+ *
+ * where \f$M\f$ is the left 3x3 block of \f$P\f$.
+ *
+ * @param projection The projection containing the pixels values and the projection matrix.
+ * @param volume The volume structure containing the absorption coefficients.
+ * @param voxelY The index of the slab (plane of voxels perpendicular to the y-axis).
+ */
+void computeVoxelBackProjection(const projection* projection, volume* volume,
+                                const int voxelY);
+
+/**
+ * @brief Normalizes the projection matrix so that the center of the volume has w = 1.
+ *
+ * A projection matrix describes the same projection when multiplied by any
+ * non-zero factor, including negative ones, while computeVoxelBackProjection()
+ * expects the voxels in front of the source to have a positive w.
+ * Exits if the matrix isn't finite or the center of the volume has w = 0.
+ *
+ * @param projection The projection whose matrix is normalized.
+ */
+void normalizeProjectionMatrix(projection* projection);
+
+/**
+ * @brief Drops a reference to the projection, freeing it if it was the last one.
+ *
+ * The reader and every row band task hold a reference to the projection,
+ * whoever finishes last frees both the pixels and the projection itself.
+ *
+ * @param projection The heap-allocated projection to release.
+ */
+void releaseProjection(projection* projection);
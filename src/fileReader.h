@@ -33,17 +33,31 @@ typedef struct projection {
     int index;
     /// Angle from which the projection was taken
     double angle;
+    /// Minimum absorption value assumed by the pixels
+    double minVal;
     /// Maximum absorption value assumed by the pixels
     double maxVal;
     /// Number of pixels on one side of the detector (square)
-    unsigned int nSidePixels;
+    int nSidePixels;
     /// 2D array of size (nPixels*nPixels) containing the pixel values
     double* pixels;
+    /// Number of holders (reader and row band tasks) still using the pixels
+    int references;
+    /// 3x4 matrix mapping homogeneous world coordinates to (col, row, 1) detector coordinates
+    double matrix[3][4];
+    /// Whether the projection matrix is provided, if not the circular trajectory is used
+    bool hasMatrix;
 } projection;
 #endif
 
 /**
- * @brief Read a PGM file containing CT projections.
+ * @brief Read the header of the next projection from a PGM file.
+ *
+ * If the read pointer is at the beginning of the file the file attributes are
+ * read as well. The projection's pixels are allocated but not read, use
+ * readProjectionRowsPGM() to read them.
+ *
+ * Projection's pixel data must be freed after use.
  *
  * @param file handle to the file to read
  * @param projection `projection` struct to store the read data into
@@ -51,10 +65,10 @@ typedef struct projection {
  * @param height pointer to the variable to store/read the height of the image
  * @param minVal pointer to the variable to store/read the minimum value of the pixels
  * @param maxVal pointer to the variable to store/read the maximum value of the pixels
- * @return `true` if the file was read successfully
- * @return `false` if an error occurred while reading the file or during memory allocation
+ * @return `true` if the header was read successfully
+ * @return `false` if an error occurred while reading the file
  */
-bool readProjectionPGM(FILE* file, projection* projection,
+bool readProjectionHeaderPGM(FILE* file, projection* projection,
                     int* width, int* height, double* minVal, double* maxVal) {
     // If the read pointer is at the beginning of the file
     if (ftell(file) == 0) {
@@ -86,6 +100,7 @@ bool readProjectionPGM(FILE* file, projection* projection,
     projection->nSidePixels = *width;
     projection->minVal = *minVal;
     projection->maxVal = *maxVal;
+    projection->hasMatrix = false;
     projection->pixels = (double*)malloc((*width) * (*width) * sizeof(double));
     // Check if the memory allocation was successful
     if (projection->pixels == NULL) {
@@ -95,15 +110,32 @@ bool readProjectionPGM(FILE* file, projection* projection,
     }
 
     // Skip lines until "#" is found
-    char line[100];
+    // (long enough to also fit the projection matrix)
+    char line[1024];
+    bool found = false;
     while (fgets(line, sizeof(line), file) != NULL) {
         if (line[0] == '#') {
+            found = true;
             break;
         }
     }
+    if (!found) {
+        return false; // End of file reached
+    }
 
-    // Read the angle from the file
-    sscanf(&line[1], "%lf", &projection->angle);
+    // Read the angle from the file, optionally followed by the
+    // 12 values of the projection matrix in row-major order
+    double* m = &projection->matrix[0][0];
+    const int nValues = sscanf(&line[1],
+        "%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", &projection->angle,
+        &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+        &m[6], &m[7], &m[8], &m[9], &m[10], &m[11]);
+    if (nValues != 1 && nValues != 13) {
+        fprintf(stderr, "Invalid projection header, expected an angle optionally followed by 12 matrix values\n");
+        fclose(file);
+        exit(EXIT_FAILURE);
+    }
+    projection->hasMatrix = nValues == 13;
 
     // Normalize the angle to be between [0, 360) degrees
     projection->angle = fmod(projection->angle + 360, 360);
@@ -117,9 +149,26 @@ bool readProjectionPGM(FILE* file, projection* projection,
     assert(projection->index >= 0 && projection->index < N_THETA);
     #endif
 
+    return true;
+}
+
+/**
+ * @brief Read a band of rows of the current projection from a PGM file.
+ *
+ * Rows must be read in order, right after readProjectionHeaderPGM().
+ *
+ * @param file handle to the file to read
+ * @param projection `projection` struct to store the read pixels into
+ * @param firstRow index of the first row to read
+ * @param lastRow index of the row after the last one to read
+ * @return `true` if the rows were read successfully
+ * @return `false` if an error occurred while reading the file
+ */
+bool readProjectionRowsPGM(FILE* file, projection* projection,
+                    const int firstRow, const int lastRow) {
     // Read the pixel values and store them in the matrix
     double pixelValue;
-    for (int x = 0; x < projection->nSidePixels; x++) {
+    for (int x = firstRow; x < lastRow; x++) {
         for (int y = 0; y < projection->nSidePixels; y++) {
             if (fscanf(file, "%lf", &pixelValue) == EOF) {
                 return false;
@@ -132,7 +181,7 @@ bool readProjectionPGM(FILE* file, projection* projection,
 }
 
 /**
- * @brief Read a DAT file containing CT projections.
+ * @brief Read a PGM file containing CT projections.
  *
  * Projection's pixel data must be freed after use.
  *
@@ -145,7 +194,31 @@ bool readProjectionPGM(FILE* file, projection* projection,
  * @return `true` if the file was read successfully
  * @return `false` if an error occurred while reading the file or during memory allocation
  */
-bool readProjectionDAT(FILE* file, projection* projection,
+bool readProjectionPGM(FILE* file, projection* projection,
+                    int* width, int* height, double* minVal, double* maxVal) {
+    return readProjectionHeaderPGM(file, projection, width, height, minVal, maxVal) &&
+           readProjectionRowsPGM(file, projection, 0, projection->nSidePixels);
+}
+
+/**
+ * @brief Read the header of the next projection from a DAT file.
+ *
+ * If the read pointer is at the beginning of the file the file attributes are
+ * read as well. The projection's pixels are allocated but not read, use
+ * readProjectionRowsDAT() to read them.
+ *
+ * Projection's pixel data must be freed after use.
+ *
+ * @param file handle to the file to read
+ * @param projection `projection` struct to store the read data into
+ * @param width pointer to the variable to store/read the width of the image
+ * @param height pointer to the variable to store/read the height of the image
+ * @param minVal pointer to the variable to store/read the minimum value of the pixels
+ * @param maxVal pointer to the variable to store/read the maximum value of the pixels
+ * @return `true` if the header was read successfully
+ * @return `false` if an error occurred while reading the file
+ */
+bool readProjectionHeaderDAT(FILE* file, projection* projection,
                     int* width, int* height, double* minVal, double* maxVal) {
     // If the read pointer is at the beginning of the file
     if (ftell(file) == 0) {
@@ -170,6 +243,7 @@ bool readProjectionDAT(FILE* file, projection* projection,
     projection->nSidePixels = *width;
     projection->minVal = *minVal;
     projection->maxVal = *maxVal;
+    projection->hasMatrix = false;
     projection->pixels = (double*)malloc((*width) * (*width) * sizeof(double));
     // Check if the memory allocation was successful
     if (projection->pixels == NULL) {
@@ -195,14 +269,81 @@ bool readProjectionDAT(FILE* file, projection* projection,
     assert(projection->index >= 0 && projection->index < N_THETA);
     #endif
 
-    // Read the pixel values and store them in the matrix
-    double pixelValue;
-    for (int x = 0; x < projection->nSidePixels; x++) {
-        for (int y = 0; y < projection->nSidePixels; y++) {
-            if (fread(&pixelValue, sizeof(double), 1, file) == 0) {
+    return true;
+}
+
+/**
+ * @brief Read a band of rows of the current projection from a DAT file.
+ *
+ * Rows must be read in order, right after readProjectionHeaderDAT().
+ *
+ * @param file handle to the file to read
+ * @param projection `projection` struct to store the read pixels into
+ * @param firstRow index of the first row to read
+ * @param lastRow index of the row after the last one to read
+ * @return `true` if the rows were read successfully
+ * @return `false` if an error occurred while reading the file
+ */
+bool readProjectionRowsDAT(FILE* file, projection* projection,
+                    const int firstRow, const int lastRow) {
+    // Rows are contiguous both in the file and in memory, read them all at once
+    const size_t nPixels = (size_t)(lastRow - firstRow) * projection->nSidePixels;
+    return fread(&projection->pixels[firstRow * projection->nSidePixels],
+                 sizeof(double), nPixels, file) == nPixels;
+}
+
+/**
+ * @brief Read a DAT file containing CT projections.
+ *
+ * Projection's pixel data must be freed after use.
+ *
+ * @param file handle to the file to read
+ * @param projection `projection` struct to store the read data into
+ * @param width pointer to the variable to store/read the width of the image
+ * @param height pointer to the variable to store/read the height of the image
+ * @param minVal pointer to the variable to store/read the minimum value of the pixels
+ * @param maxVal pointer to the variable to store/read the maximum value of the pixels
+ * @return `true` if the file was read successfully
+ * @return `false` if an error occurred while reading the file or during memory allocation
+ */
+bool readProjectionDAT(FILE* file, projection* projection,
+                    int* width, int* height, double* minVal, double* maxVal) {
+    return readProjectionHeaderDAT(file, projection, width, height, minVal, maxVal) &&
+           readProjectionRowsDAT(file, projection, 0, projection->nSidePixels);
+}
+
+/**
+ * @brief Read the projection matrices from a text file.
+ *
+ * The file contains the 12 values of each 3x4 matrix in row-major order,
+ * separated by whitespace, one matrix per projection in the same order as the
+ * projections in the input file. Lines starting with "#" are ignored.
+ *
+ * @param file handle to the file to read
+ * @param matrices array to store the read matrices into
+ * @param nMatrices number of matrices to read
+ * @return `true` if all of the matrices were read successfully
+ * @return `false` if an error occurred while reading the file
+ */
+bool readProjectionMatrices(FILE* file, double matrices[][3][4], const int nMatrices) {
+    for (int i = 0; i < nMatrices; i++) {
+        double* m = &matrices[i][0][0];
+        for (int j = 0; j < 12; j++) {
+            // Skip whitespace and comment lines
+            int c;
+            while ((c = fgetc(file)) != EOF && (isspace(c) || c == '#')) {
+                if (c == '#') {
+                    while ((c = fgetc(file)) != EOF && c != '\n');
+                }
+            }
+            if (c == EOF) {
+                return false;
+            }
+            ungetc(c, file);
+
+            if (fscanf(file, "%lf", &m[j]) != 1) {
                 return false;
             }
-            projection->pixels[x * projection->nSidePixels + y] = pixelValue;
         }
     }
 